@@ -39,12 +39,9 @@
 
   - Fix:
     - Fix returnperror() exit codes.
-    - Add 8bit support via command line flag - might be necessary for
-      Linux console.
     - Have fewer dark colours.
     - Need to add buffer overflow protection for keep.
     - Leave ansisequence after n unrecognised bytes.
-    - Leave utf8 after 4 unrecognised bytes.
 
 
   - Ideas:
@@ -54,7 +51,7 @@
 */
 
 
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 
 
 #define DEFAULT_SHELL "/bin/bash"
@@ -64,6 +61,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -74,6 +72,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 
 int returnperror(const char *s, int status) {
   perror(s);
@@ -97,11 +99,21 @@ int rainbow(float freq, float i, int *red, int *green, int *blue) {
 }
 
 
-int ansicolour8bit(FILE *stream, int red, int green, int blue) {
+static int g_8bit;
+static int g_compress;
+static const char *g_transcript;
+
+
+int ansicolour8bitindex(int red, int green, int blue) {
   int red1 = red / 256.0 * 5;
   int green1 = green / 256.0 * 5;
   int blue1 = blue / 256.0 * 5;
-  int colour = 16 + 36 * red1 + 6 * green1 + blue1;
+  return 16 + 36 * red1 + 6 * green1 + blue1;
+}
+
+
+int ansicolour8bit(FILE *stream, int red, int green, int blue) {
+  int colour = ansicolour8bitindex(red, green, blue);
   return fprintf(stream, "\x1b[38;5;%dm", colour);
 }
 
@@ -116,6 +128,150 @@ int ansicolourreset(FILE *stream) {
 }
 
 
+/*
+  - Context:
+    - Parser and emitter state for one output stream.
+    - colour is the colour last selected on the terminal, or -1 when
+      unknown, e.g. after passing through an escape sequence.
+    - rep is the last graphic character written and repcount the number
+      of further copies of it held back for REP.
+*/
+struct context;
+
+
+typedef void *(*parserfunction)(float freq, float spread, float os,
+                                struct context *c,
+                                char ch);
+
+
+struct context {
+  FILE *stream;
+
+  int row;
+  int column;
+  int prevrow;
+  int prevcolumn;
+  char keep[1024];
+  int keepi;
+  parserfunction parser;
+
+  int colour;
+  char rep[8];
+  int repcount;
+};
+
+
+int ansicolourkey(int red, int green, int blue) {
+  if (g_8bit)
+    return ansicolour8bitindex(red, green, blue);
+  else
+    return (red << 16) | (green << 8) | blue;
+}
+
+
+int ansicolour(struct context *c, int red, int green, int blue) {
+  int colour = ansicolourkey(red, green, blue);
+  if (colour == c->colour)
+    return 0;
+
+  c->colour = colour;
+  if (g_8bit)
+    return ansicolour8bit(c->stream, red, green, blue);
+  else
+    return ansicolour24bit(c->stream, red, green, blue);
+}
+
+
+/*
+  - REP repeats printable ASCII including space, so runs of blanks are sent
+    as one space and 'CSI n b', and single width UTF-8 glyphs such as box
+    drawing.  Combining and zero width characters are never repeated as
+    REP would not reproduce them.
+
+  - See:
+    - XTerm Control Sequences.
+      - 'CSI n b' - REP - Repeat the preceding graphic character.
+
+    - ECMA-48 - Control Functions for Coded Character Sets.
+      - 8.3.103 REP - Repeat.
+*/
+int emitrepeatable(const char *glyph) {
+  const unsigned char *g = (const unsigned char *)glyph;
+  int codepoint;
+
+  if (g[1] == '\0')
+    return isprint(g[0]);
+  else if ((g[0] >> 5) == 0b110)
+    codepoint = ((g[0] & 0x1f) << 6) | (g[1] & 0x3f);
+  else if ((g[0] >> 4) == 0b1110)
+    codepoint = ((g[0] & 0x0f) << 12) | ((g[1] & 0x3f) << 6) | (g[2] & 0x3f);
+  else
+    return 0;
+
+  return /* Latin-1 Supplement and Latin Extended: */
+           (codepoint >= 0x00a1 && codepoint <= 0x024f && codepoint != 0xad) ||
+         /* General Punctuation, excluding zero width and format: */
+           (codepoint >= 0x2010 && codepoint <= 0x2027) ||
+           (codepoint >= 0x2030 && codepoint <= 0x205e) ||
+         /* Arrows: */
+           (codepoint >= 0x2190 && codepoint <= 0x21ff) ||
+         /* Box Drawing, Block Elements and Geometric Shapes: */
+           (codepoint >= 0x2500 && codepoint <= 0x25ff);
+}
+
+
+int emitflush(struct context *c) {
+  char seq[32];
+  int i;
+
+  if (c->repcount > 0) {
+    snprintf(seq, sizeof(seq), "\x1b[%db", c->repcount);
+    if (strlen(seq) < c->repcount * strlen(c->rep))
+      fputs(seq, c->stream);
+    else
+      for (i = 0; i < c->repcount; i++)
+        fputs(c->rep, c->stream);
+    c->repcount = 0;
+  }
+
+  return 0;
+}
+
+
+int emit(struct context *c, const char *glyph,
+         int red, int green, int blue) {
+  if (!g_compress) {
+    ansicolour(c, red, green, blue);
+    return fputs(glyph, c->stream);
+  }
+
+  if (c->rep[0] != '\0' && strcmp(glyph, c->rep) == 0 &&
+      ansicolourkey(red, green, blue) == c->colour) {
+    c->repcount++;
+    return 0;
+  }
+
+  emitflush(c);
+  ansicolour(c, red, green, blue);
+  fputs(glyph, c->stream);
+
+  if (emitrepeatable(glyph))
+    strcpy(c->rep, glyph);
+  else
+    c->rep[0] = '\0';
+
+  return 0;
+}
+
+
+int emitsequence(struct context *c, const char *seq) {
+  emitflush(c);
+  c->colour = -1;
+  c->rep[0] = '\0';
+  return fputs(seq, c->stream);
+}
+
+
 int pty(int *fdmaster, int *fdslave) {
   if ((*fdmaster = open("/dev/ptmx", O_RDWR)) == -1)
     return returnperror("open()", -1);
@@ -229,30 +385,61 @@ int parsenandm(const char *s, int *n, int *m) {
 }
 
 
-typedef void *(*parserfunction)(float freq, float spread, float os,
-                                int *row, int *column,
-                                char *keep, int *keepi,
-                                char ch);
-
-
 void *parseescapesequence(float freq, float spread, float os,
-                          int *row, int *column,
-                          char *keep, int *keepi,
+                          struct context *c,
                           char ch);
 
 
 void *parseutf8(float freq, float spread, float os,
-                int *row, int *column,
-                char *keep, int *keepi,
+                struct context *c,
                 char ch);
 
 
 void *parsetext(float freq, float spread, float os,
-                int *row, int *column,
-                char *keep, int *keepi,
+                struct context *c,
                 char ch);
 
 
+int escapesequencecsi(const char *keep, int keepi) {
+  return /* ANSI:  CSI - Control Sequence Introducer: */
+           keepi >= 2 && keep[1] == '[' &&
+           (isalpha(keep[keepi - 1]) || keep[keepi - 1] == '@');
+}
+
+
+int escapesequenceend(const char *keep, int keepi) {
+  if (keepi < 2)
+    return 0;
+
+  return escapesequencecsi(keep, keepi) ||
+         /* ANSI:  OSC - Operating System Command: */
+         /*  - Used by vte to report state, e.g. */
+         /*    ESC ] 777;notify;Command completed;sleep 5\a, then, */
+         /*    ESC ] 0;chris@holzer:~/c\a, then, */
+         /*    ESC ] 7;file://hostname.domainname/home/chris/c\a */
+           (keep[1] == ']' && keep[keepi - 1] == '\a') ||
+         /* ANSI:  OSC - Operating System Command: */
+           (keep[1] == ']' &&
+            keep[keepi - 2] == '\x1b' && keep[keepi - 1] == '\\') ||
+         /* ANSI:  DCS - Device Control String: */
+           (keep[1] == 'P' &&
+            keep[keepi - 2] == '\x1b' && keep[keepi - 1] == '\\') ||
+         /* Other: */
+           (keepi == 3 && keep[1] == '(') ||
+           (keepi == 3 && keep[1] == ')') ||
+           (keepi == 2 && keep[1] == '=') ||
+           (keepi == 2 && keep[1] == '>') ||
+           (keepi == 2 && keep[1] == '7') ||
+           (keepi == 2 && keep[1] == '8') ||
+           (keepi == 2 && keep[1] == 'H') ||
+           (keepi == 2 && keep[1] == 'M') ||
+           (keepi == 2 && keep[1] == 'c') ||
+         /* screen/tmux:  'ESC k title ESC \' - Set title - Emitted by nyancat */
+           keep[1] == 'k' ||
+           keep[1] == '\\';
+}
+
+
 /*
   - See:
     - ANSI escape code.
@@ -271,41 +458,38 @@ void *parsetext(float freq, float spread, float os,
       - https://invisible-island.net/ncurses/terminfo.src.html
 */
 void *parseescapesequence(float freq, float spread, float os,
-                          int *row, int *column,
-                          char *keep, int *keepi,
+                          struct context *c,
                           char ch) {
-  static int prevrow;
-  static int prevcolumn;
-
-  keep[(*keepi)++] = ch;
+  c->keep[c->keepi++] = ch;
 
   const char *xtermenablealternativebuffer = "\x1b[?1049h";
   const char *xtermdisablealternativebuffer = "\x1b[?1049l";
   if (/* xterm:  Enable alternative screen buffer: */
-        (*keepi == strlen(xtermenablealternativebuffer)) &&
-        (strncmp(keep, xtermenablealternativebuffer, *keepi) == 0)) {
-    prevrow = *row;
-    prevcolumn = *column;
+        (c->keepi == strlen(xtermenablealternativebuffer)) &&
+        (strncmp(c->keep, xtermenablealternativebuffer, c->keepi) == 0)) {
+    c->prevrow = c->row;
+    c->prevcolumn = c->column;
   }
   else if (/* xterm:  Disable alternative screen buffer: */
-             (*keepi == strlen(xtermdisablealternativebuffer)) &&
-             (strncmp(keep, xtermdisablealternativebuffer, *keepi) == 0)) {
-    *row = prevrow;
-    *column = prevcolumn;
+             (c->keepi == strlen(xtermdisablealternativebuffer)) &&
+             (strncmp(c->keep, xtermdisablealternativebuffer, c->keepi) == 0)) {
+    c->row = c->prevrow;
+    c->column = c->prevcolumn;
   }
   else if (/* ANSI:  RIS - Reset. */
-             *keepi == 2 && keep[1] == 'c') {
-    *row = 1;
-    *column = 1;
+             c->keepi == 2 && c->keep[1] == 'c') {
+    c->row = 1;
+    c->column = 1;
   }
 
-  if (/* ANSI:  CSI - Control Sequence Introducer: */
-        keep[1] == '[' &&
-        (isalpha(keep[*keepi - 1]) || keep[*keepi - 1] == '@')) {
+  if (!escapesequenceend(c->keep, c->keepi))
+    return parseescapesequence;
+
+  if (escapesequencecsi(c->keep, c->keepi)) {
     int n;
     int m;
 
-    parsenandm(keep + 2, &n, &m);
+    parsenandm(c->keep + 2, &n, &m);
 
     if (n == 0)
       n = 1;
@@ -313,107 +497,76 @@ void *parseescapesequence(float freq, float spread, float os,
     if (m == 0)
       m = 1;
 
-    switch (keep[*keepi - 1]) {
+    switch (c->keep[c->keepi - 1]) {
     case 'A': /* ANSI:  'CSI n A' - CUU - Cursor Up: */
-              *row -= n;
+              c->row -= n;
               break;
     case 'B': /* ANSI:  'CSI n B' - CUD - Cursor Down: */
-              *row += n;
+              c->row += n;
               break;
     case 'C': /* ANSI:  'CSI n C' - CUF - Cursor Forward: */
-              *column += n;
+              c->column += n;
               break;
     case 'D': /* ANSI:  'CSI n D' - CUB - Cursor Back: */
-              *column -= n;
+              c->column -= n;
               break;
     case 'E': /* ANSI:  'CSI n E' - CNL - Cursor Next Line: */
-              *row += n;
-              *column = 1;
+              c->row += n;
+              c->column = 1;
               break;
     case 'F': /* ANSI:  'CSI n F' - CPL - Cursor Previous Line: */
-              *row -= n;
-              *column = 1;
+              c->row -= n;
+              c->column = 1;
               break;
     case 'G': /* ANSI:  'CSI n G' - CHA - Cursor Horizontal Absolute: */
-              *column = n;
+              c->column = n;
               break;
     case 'H': /* ANSI:  'CSI n ; m H' - CUP - Cursor Position: */
-              *row = n;
-              *column = m;
+              c->row = n;
+              c->column = m;
               break;
     case 'f': /* ANSI:  'CSI n ; m f' - HVP - Horizontal Vertical Position: */
-              *row = n;
-              *column = m;
+              c->row = n;
+              c->column = m;
               break;
     case '@': /* ANSI:  'CSI n @' - ICH - Insert Characters: */
               break;
     }
-    keep[*keepi] = '\0';
-    fputs(keep, stdout);
-    *keepi = 0;
-    return parsetext;
   }
 
-  if (/* ANSI:  OSC - Operating System Command: */
-      /*  - Used by vte to report state, e.g. */
-      /*    ESC ] 777;notify;Command completed;sleep 5\a, then, */
-      /*    ESC ] 0;chris@holzer:~/c\a, then, */
-      /*    ESC ] 7;file://hostname.domainname/home/chris/c\a */
-        (keep[1] == ']' && keep[*keepi - 1] == '\a') ||
-      /* ANSI:  OSC - Operating System Command: */
-        (keep[1] == ']' &&
-         keep[*keepi - 2] == '\x1b' && keep[*keepi - 1] == '\\') ||
-      /* ANSI:  DCS - Device Control String: */
-        (keep[1] == 'P' &&
-         keep[*keepi - 2] == '\x1b' && keep[*keepi - 1] == '\\') ||
-      /* Other: */
-        (*keepi == 3 && keep[1] == '(') ||
-        (*keepi == 3 && keep[1] == ')') ||
-        (*keepi == 2 && keep[1] == '=') ||
-        (*keepi == 2 && keep[1] == '>') ||
-        (*keepi == 2 && keep[1] == '7') ||
-        (*keepi == 2 && keep[1] == '8') ||
-        (*keepi == 2 && keep[1] == 'H') ||
-        (*keepi == 2 && keep[1] == 'M') ||
-        (*keepi == 2 && keep[1] == 'c')) {
-    keep[*keepi] = '\0';
-    fputs(keep, stdout);
-    *keepi = 0;
-    return parsetext;
-  }
-
-  if (/* screen/tmux:  'ESC k title ESC \' - Set title - Emitted by nyancat */
-        keep[1] == 'k' ||
-        keep[1] == '\\') {
-    keep[*keepi] = '\0';
-    fputs(keep, stdout);
-    *keepi = 0;
-    return parsetext;
-  }
-
-  return parseescapesequence;
+  c->keep[c->keepi] = '\0';
+  emitsequence(c, c->keep);
+  c->keepi = 0;
+  return parsetext;
 }
 
 
 void *parseutf8(float freq, float spread, float os,
-                int *row, int *column,
-                char *keep, int *keepi,
+                struct context *c,
                 char ch) {
   int red;
   int green;
   int blue;
 
-  keep[(*keepi)++] = ch;
-
-  if ((*keepi == 2 && (((unsigned char)keep[0] >> 5) == 0b110)) ||
-      (*keepi == 3 && (((unsigned char)keep[0] >> 4) == 0b1110)) ||
-      (*keepi == 4 && (((unsigned char)keep[0] >> 3) == 0b11110))) {
-    *column += 1;
-    keep[*keepi] = '\0';
-    rainbow(freq, os + *row + *column / spread, &red, &green, &blue);
-    ansicolour24bit(stdout, red, green, blue);
-    fputs(keep, stdout);
-    *keepi = 0;
+  if (/* Invalid:  Not a continuation byte - pass through what is kept */
+      /*           and parse ch afresh. */
+        ((unsigned char)ch >> 6) != 0b10) {
+    c->keep[c->keepi] = '\0';
+    emitsequence(c, c->keep);
+    c->keepi = 0;
+    return parsetext(freq, spread, os, c, ch);
+  }
+
+  c->keep[c->keepi++] = ch;
+
+  if ((c->keepi == 2 && (((unsigned char)c->keep[0] >> 5) == 0b110)) ||
+      (c->keepi == 3 && (((unsigned char)c->keep[0] >> 4) == 0b1110)) ||
+      (c->keepi == 4 && (((unsigned char)c->keep[0] >> 3) == 0b11110))) {
+    c->column += 1;
+    c->keep[c->keepi] = '\0';
+    rainbow(freq, os + c->row + c->column / spread, &red, &green, &blue);
+    emit(c, c->keep, red, green, blue);
+    c->keepi = 0;
     return parsetext;
   }
 
@@ -422,89 +575,410 @@ void *parseutf8(float freq, float spread, float os,
 
 
 void *parsetext(float freq, float spread, float os,
-                int *row, int *column,
-                char *keep, int *keepi,
+                struct context *c,
                 char ch) {
   int red;
   int green;
   int blue;
 
   if (ch == '\x1b') {
-    *keepi = 0;
-    keep[(*keepi)++] = ch;
+    c->keepi = 0;
+    c->keep[c->keepi++] = ch;
     return parseescapesequence;
   }
 
   if (ch & 128) {
-    *keepi = 0;
-    keep[(*keepi)++] = ch;
-    return parseutf8;
+    c->keepi = 0;
+    c->keep[c->keepi++] = ch;
+    if (((unsigned char)ch >> 5) == 0b110 ||
+        ((unsigned char)ch >> 4) == 0b1110 ||
+        ((unsigned char)ch >> 3) == 0b11110)
+      return parseutf8;
+
+    /* Invalid:  Stray continuation or lead byte - pass through. */
+    c->keep[c->keepi] = '\0';
+    emitsequence(c, c->keep);
+    c->keepi = 0;
+    return parsetext;
   }
 
   if (ch == '\n') {
-    *row += 1;
-    *column = 1;
+    c->row += 1;
+    c->column = 1;
   } else if (ch == '\b')
-    *column -= 1;
+    c->column -= 1;
   else if (ch == '\r')
-    *column = 1;
+    c->column = 1;
   else if (ch == '\t')
-    *column += 8 - (*column % 8);
+    c->column += 8 - (c->column % 8);
   else
-    *column += 1;
+    c->column += 1;
 
-  rainbow(freq, os + *row + *column / spread, &red, &green, &blue);
-  ansicolour24bit(stdout, red, green, blue);
-  fputc(ch, stdout);
+  rainbow(freq, os + c->row + c->column / spread, &red, &green, &blue);
+  emit(c, (char []){ ch, '\0' }, red, green, blue);
   return parsetext;
 }
 
 
-int output(FILE *stdout,
+int contextinit(struct context *c, FILE *stream) {
+  memset(c, 0, sizeof(*c));
+  c->stream = stream;
+  c->row = 1;
+  c->column = 1;
+  c->parser = parsetext;
+  c->colour = -1;
+  return 0;
+}
+
+
+int output(struct context *c,
            const char *buf,
            int count,
            float freq,
            float spread,
            float os) {
-  static int row = 1;
-  static int column = 1;
+  int i;
+  for (i = 0; i < count; i++) {
+    c->parser = c->parser(freq, spread, os, c, buf[i]);
+  }
 
-  static char keep[1024];
-  static int keepi;
+  emitflush(c);
 
-  static parserfunction parser = parsetext;
+  for (;;) {
+    fflush(c->stream);
+    if (!ferror(c->stream))
+      break;
+    clearerr(c->stream);
+  }
 
-  int i;
-  for (i = 0; i < count; i++) {
-    parser = parser(freq, spread, os, &row, &column, keep, &keepi, buf[i]);
+  return 0;
+}
+
+
+/*
+  - Strip:
+    - Copies text between escape sequences and control characters as spans,
+      keeping only newlines, tabs, carriage returns and backspaces, so
+      output is never longer than input.
+    - Carriage returns and backspaces are kept rather than applied, so that
+      progress bars and overstrikes replay as they were displayed, e.g. with
+      cat, or can be flattened with col -b.
+    - Escape sequences are recognised with stripsequenceend() and may span
+      calls.  Sequences longer than keep are abandoned.
+*/
+struct strip {
+  char keep[1024];
+  int keepi;
+};
+
+
+int stripscan(const char *buf, int count) {
+  int i = 0;
+
+#ifdef __SSE2__
+  const __m128i control = _mm_set1_epi8(0x1f);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  for (; i + 16 <= count; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *)(buf + i));
+    __m128i y = _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(x, control), x),
+                             _mm_cmpeq_epi8(x, del));
+    int mask = _mm_movemask_epi8(y);
+    if (mask)
+      return i + __builtin_ctz(mask);
   }
+#endif
+
+  for (; i < count; i++)
+    if ((unsigned char)buf[i] < ' ' || buf[i] == 0x7f)
+      break;
+
+  return i;
+}
+
+
+/*
+  - Unlike escapesequenceend() this ends every sequence on its final byte
+    so that unrecognised sequences never swallow text:
+    - CSI ends on 0x40 - 0x7e.
+    - OSC and DCS end on BEL or ST.
+    - screen/tmux 'ESC k title ESC \' ends on ST.
+    - Otherwise intermediate bytes 0x20 - 0x2f are skipped and the sequence
+      ends on 0x30 - 0x7e, e.g. 'ESC D', 'ESC # 8', 'ESC % G', 'ESC ( B'.
+*/
+int stripsequenceend(const char *keep, int keepi) {
+  char ch = keep[keepi - 1];
+
+  if (keepi < 2)
+    return 0;
+  else if (keep[1] == '[')
+    return keepi > 2 && ch >= 0x40 && ch <= 0x7e;
+  else if (keep[1] == ']' || keep[1] == 'P')
+    return escapesequenceend(keep, keepi);
+  else if (keep[1] == 'k')
+    return keepi > 2 && keep[keepi - 2] == '\x1b' && ch == '\\';
+  else
+    return ch >= 0x30 && ch <= 0x7e;
+}
+
+
+int strip(struct strip *s, const char *buf, int count, char *out) {
+  int i = 0;
+  int o = 0;
+
+  while (i < count) {
+    if (s->keepi > 0) {
+      s->keep[s->keepi++] = buf[i++];
+      if (stripsequenceend(s->keep, s->keepi) ||
+          s->keepi == sizeof(s->keep))
+        s->keepi = 0;
+      continue;
+    }
+
+    int n = stripscan(buf + i, count - i);
+    memcpy(out + o, buf + i, n);
+    o += n;
+    i += n;
+
+    if (i == count)
+      break;
+
+    char ch = buf[i++];
+    if (ch == '\x1b')
+      s->keep[s->keepi++] = ch;
+    else if (ch == '\n' || ch == '\t' || ch == '\r' || ch == '\b')
+      out[o++] = ch;
+  }
+
+  return o;
+}
+
+
+int writeall(int fd, const char *buf, int count) {
+  int nwritten;
+
+  while (count > 0) {
+    nwritten = write(fd, buf, count);
+    if (nwritten == -1 && errno == EINTR)
+      continue;
+    else if (nwritten == -1)
+      return -1;
+    buf += nwritten;
+    count -= nwritten;
+  }
+
+  return 0;
+}
+
+
+int stripfilter(int fdin, int fdout) {
+  static char buf[65536];
+  static char out[65536];
+  struct strip s = { .keepi = 0 };
+  int nread;
 
   for (;;) {
-    fflush(stdout);
-    if (!ferror(stdout))
+    nread = read(fdin, buf, sizeof(buf));
+    if (nread == 0)
       break;
-    clearerr(stdout);
+    else if (nread == -1 && errno == EINTR)
+      continue;
+    else if (nread == -1)
+      return returnperror("read()", -1);
+
+    if (writeall(fdout, out, strip(&s, buf, nread, out)) == -1)
+      return returnperror("write()", -1);
+  }
+
+  return 0;
+}
+
+
+/*
+  - Writer:
+    - Background thread draining a ring buffer to a file so that slow
+      transcript I/O never stalls the interactive path.
+    - writerput() never blocks on I/O - data that does not fit is dropped
+      and counted.
+    - The first write error is latched in error, after which everything is
+      dropped.  It is reported by writerstop().
+*/
+#define WRITER_SIZE (1024 * 1024)
+
+
+struct writer {
+  int fd;
+  char *buf;
+  int head;
+  int count;
+  long dropped;
+  int error;
+  int stop;
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+
+void *writerthread(void *arg) {
+  struct writer *w = arg;
+
+  pthread_mutex_lock(&w->mutex);
+  for (;;) {
+    while (w->count == 0 && !w->stop)
+      pthread_cond_wait(&w->cond, &w->mutex);
+    if (w->count == 0)
+      break;
+
+    int n = w->count;
+    if (n > WRITER_SIZE - w->head)
+      n = WRITER_SIZE - w->head;
+
+    pthread_mutex_unlock(&w->mutex);
+    int error = writeall(w->fd, w->buf + w->head, n) == -1 ? errno : 0;
+    pthread_mutex_lock(&w->mutex);
+
+    w->head = (w->head + n) % WRITER_SIZE;
+    w->count -= n;
+
+    if (error) {
+      w->error = error;
+      w->dropped += w->count;
+      w->count = 0;
+    }
+  }
+  pthread_mutex_unlock(&w->mutex);
+
+  return NULL;
+}
+
+
+int writeropen(struct writer *w, const char *path) {
+  if ((w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                    0666)) == -1)
+    return returnperror("open()", -1);
+
+  if ((w->buf = malloc(WRITER_SIZE)) == NULL)
+    return returnperror("malloc()", -1);
+
+  w->head = 0;
+  w->count = 0;
+  w->dropped = 0;
+  w->error = 0;
+  w->stop = 0;
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->cond, NULL);
+
+  return 0;
+}
+
+
+int writerstart(struct writer *w) {
+  if ((errno = pthread_create(&w->thread, NULL, writerthread, w)) != 0)
+    return returnperror("pthread_create()", -1);
+
+  return 0;
+}
+
+
+int writerput(struct writer *w, const char *buf, int count) {
+  pthread_mutex_lock(&w->mutex);
+
+  int n = w->error ? 0 : count;
+  w->dropped += count - n;
+  if (n > WRITER_SIZE - w->count) {
+    w->dropped += n - (WRITER_SIZE - w->count);
+    n = WRITER_SIZE - w->count;
+  }
+
+  int tail = (w->head + w->count) % WRITER_SIZE;
+  int n1 = n < WRITER_SIZE - tail ? n : WRITER_SIZE - tail;
+  memcpy(w->buf + tail, buf, n1);
+  memcpy(w->buf, buf + n1, n - n1);
+  w->count += n;
+
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+
+  return n;
+}
+
+
+int writerstop(struct writer *w) {
+  pthread_mutex_lock(&w->mutex);
+  w->stop = 1;
+  pthread_cond_signal(&w->cond);
+  pthread_mutex_unlock(&w->mutex);
+
+  pthread_join(w->thread, NULL);
+  free(w->buf);
+
+  if (w->dropped > 0)
+    fprintf(stderr, "rainbow: transcript dropped %ld bytes\n", w->dropped);
+
+  if (close(w->fd) == -1)
+    return returnperror("close()", -1);
+
+  if (w->error) {
+    errno = w->error;
+    return returnperror("write()", -1);
   }
 
   return 0;
 }
 
 
-int loop(FILE *stdout, int fdstdin, int fdmaster, int childpid) {
+/*
+  - I/O:
+    - loop() reaches its file descriptors only through struct io so that it
+      can be run against the simulation as well as real ptys.
+*/
+struct io {
+  int (*select)(struct io *io, int nfds, fd_set *readfds);
+  int (*read)(struct io *io, int fd, char *buf, int count);
+  int (*write)(struct io *io, int fd, const char *buf, int count);
+};
+
+
+int ioselect(struct io *io, int nfds, fd_set *readfds) {
+  return select(nfds, readfds, NULL, NULL, NULL);
+}
+
+
+int ioread(struct io *io, int fd, char *buf, int count) {
+  return read(fd, buf, count);
+}
+
+
+int iowrite(struct io *io, int fd, const char *buf, int count) {
+  return write(fd, buf, count);
+}
+
+
+static struct io g_io = { ioselect, ioread, iowrite };
+
+
+int loop(struct io *io, FILE *stdout, int fdstdin, int fdmaster, int childpid,
+         struct writer *transcript) {
   float freq = 0.1;
   float spread = 3.0;
   float os = random() * 1.0 / RAND_MAX * 255;
 
   fd_set readfds;
   char buf[1024];
+  char out[1024];
   int nread;
 
+  struct context c;
+  contextinit(&c, stdout);
+
+  struct strip strip1 = { .keepi = 0 };
+
   for (;;) {
     FD_ZERO(&readfds);
     FD_SET(fdstdin, &readfds);
     FD_SET(fdmaster, &readfds);
 
-    if (select(fdmaster + 1, &readfds, NULL, NULL, NULL) == -1) {
+    if (io->select(io, fdmaster + 1, &readfds) == -1) {
       if (errno == EINTR)
         continue;
       else if (errno == EBADF)
@@ -514,22 +988,25 @@ int loop(FILE *stdout, int fdstdin, int fdmaster, int childpid) {
     }
 
     if (FD_ISSET(fdstdin, &readfds)) {
-      nread = read(fdstdin, buf, 1024);
+      nread = io->read(io, fdstdin, buf, 1024);
       if (nread == -1)
         return returnperror("read()", -1);
-      else if (write(fdmaster, buf, nread) != nread)
+      else if (io->write(io, fdmaster, buf, nread) != nread)
         return returnperror("write()", -1);
     }
 
     if (FD_ISSET(fdmaster, &readfds)) {
-      nread = read(fdmaster, buf, 1024);
+      nread = io->read(io, fdmaster, buf, 1024);
       if (nread == 0 ||
           (nread == -1 && errno == EIO))
         break;
       else if (nread == -1)
         return returnperror("read()", -1);
-      else if (output(stdout, buf, nread, freq, spread, os) == -1)
+      if (output(&c, buf, nread, freq, spread, os) == -1)
         return returnperror("output()", -1);
+
+      if (transcript)
+        writerput(transcript, out, strip(&strip1, buf, nread, out));
     }
   }
 
@@ -537,25 +1014,349 @@ int loop(FILE *stdout, int fdstdin, int fdmaster, int childpid) {
 }
 
 
-int parent(int fdmaster, int fdslave, int childpid) {
+int parent(int fdmaster, int fdslave, int childpid,
+           struct writer *transcript) {
   if (windowsizecopy(STDIN_FILENO, fdmaster) == -1)
     return -1;
 
   if (signals(STDIN_FILENO, fdmaster, fdslave) == -1)
     return -1;
 
+  if (transcript && writerstart(transcript) == -1)
+    return -1;
+
   struct termios t;
   if (termiosraw(STDIN_FILENO, &t) == -1)
     return -1;
 
-  if (loop(stdout, STDIN_FILENO, fdmaster, childpid) == -1)
-    return -1;
+  int status = loop(&g_io, stdout, STDIN_FILENO, fdmaster, childpid,
+                    transcript);
+
+  if (termiosreset(STDIN_FILENO, &t) == -1 ||
+      ansicolourreset(stdout) == -1)
+    status = -1;
+
+  /* Also after loop() fails so that queued transcript is written. */
+  if (transcript && writerstop(transcript) == -1)
+    status = -1;
+
+  return status;
+}
+
+
+/*
+  - Simulation:
+    - Runs loop() against a simulated clock instead of real ptys so that
+      scheduling and flow control can be compared reproducibly.
+    - The child writes a second's worth of a repeating pattern at rate bytes
+      per second into a pty buffer of SIM_PTY bytes and blocks while it is
+      full.
+    - keys keystrokes arrive keyinterval apart and are echoed by the child
+      behind whatever output is already queued.  Latency is measured from
+      the keystroke to loop() having written the echo to the terminal.
+    - The terminal is a memory stream drained at bandwidth bytes per second
+      as each flush is seen and then rewound, so it only ever holds one
+      flush, and each system call costs SIM_SYSCALL.
+      Times are in nanoseconds.
+    - Throughput is measured up to the child's output having been written
+      to the terminal.
+*/
+#define SIM_FDSTDIN 0
+#define SIM_FDMASTER 1
+#define SIM_PTY 4096
+#define SIM_CHUNK 256
+#define SIM_KEYS 1024
+#define SIM_SYSCALL 2000LL
+#define SIM_NS 1000000000LL
+
+
+struct simulation {
+  struct io io;
+
+  const char *pattern;
+  long long rate;
+  long long total;
+  long long bandwidth;
+  long long keyinterval;
+  int keys;
+
+  FILE *stream;
+  char *buf;
+  size_t size;
+
+  long long now;
+  long long donetime;
+  long long childtime;
+  long long produced;
+
+  char queue[SIM_PTY + SIM_KEYS];
+  int head;
+  int count;
+  long long enqueued;
+  long long dequeued;
+
+  long long keytime[SIM_KEYS];
+  long long keypos[SIM_KEYS];
+  int keyread;
+  int keyn;
+  int keydelivered;
+  int keydisplayed;
+
+  long long bytesout;
+  long long latency;
+  long long latencymax;
+  int reads;
+};
+
+
+int simenqueue(struct simulation *sim, const char *buf, int count) {
+  int i;
+  for (i = 0; i < count; i++)
+    sim->queue[(sim->head + sim->count++) % sizeof(sim->queue)] = buf[i];
+  sim->enqueued += count;
+  return count;
+}
+
+
+int simchild(struct simulation *sim) {
+  int patternlen = strlen(sim->pattern);
+  char chunk[SIM_CHUNK];
+  int n;
+  int i;
+
+  while (sim->childtime <= sim->now && sim->produced < sim->total &&
+         sim->count + SIM_CHUNK <= SIM_PTY) {
+    n = sim->total - sim->produced < SIM_CHUNK ?
+          sim->total - sim->produced : SIM_CHUNK;
+    for (i = 0; i < n; i++)
+      chunk[i] = sim->pattern[(sim->produced + i) % patternlen];
+    simenqueue(sim, chunk, n);
+    sim->produced += n;
+    sim->childtime += n * SIM_NS / sim->rate;
+  }
+
+  /* Blocked on a full pty - no catching up afterwards. */
+  if (sim->childtime < sim->now)
+    sim->childtime = sim->now;
+
+  return 0;
+}
+
 
-  if (termiosreset(STDIN_FILENO, &t) == -1)
+int simterminal(struct simulation *sim) {
+  if (sim->size == 0)
+    return 0;
+
+  sim->now += SIM_SYSCALL + sim->size * SIM_NS / sim->bandwidth;
+  sim->bytesout += sim->size;
+
+  /* Drained - rewind, and flush so that size restarts from 0. */
+  if (fseek(sim->stream, 0, SEEK_SET) == -1 || fflush(sim->stream) == EOF)
+    return returnperror("fseek()", -1);
+  return 0;
+}
+
+
+int simselect(struct io *io, int nfds, fd_set *readfds) {
+  struct simulation *sim = (struct simulation *)io;
+  if (simterminal(sim) == -1)
     return -1;
+  sim->now += SIM_SYSCALL;
+
+  for (; sim->keydisplayed < sim->keydelivered; sim->keydisplayed++) {
+    long long latency = sim->now - sim->keytime[sim->keydisplayed];
+    sim->latency += latency;
+    if (latency > sim->latencymax)
+      sim->latencymax = latency;
+  }
+
+  if (!sim->donetime &&
+      sim->produced >= sim->total && sim->dequeued == sim->enqueued)
+    sim->donetime = sim->now;
+
+  for (;;) {
+    simchild(sim);
+
+    long long keytime = (sim->keyread + 1) * sim->keyinterval;
+    int keysleft = sim->keyread < sim->keys;
+    int stdinready = keysleft && keytime <= sim->now;
+    int masterready = sim->count > 0 ||
+                      (!keysleft && sim->produced >= sim->total);
+
+    if (stdinready || masterready) {
+      if (!stdinready)
+        FD_CLR(SIM_FDSTDIN, readfds);
+      if (!masterready)
+        FD_CLR(SIM_FDMASTER, readfds);
+      return stdinready + masterready;
+    }
+
+    long long next = keysleft ? keytime : sim->childtime;
+    if (sim->produced < sim->total && sim->childtime < next)
+      next = sim->childtime;
+    if (next > sim->now)
+      sim->now = next;
+  }
+}
+
+
+int simread(struct io *io, int fd, char *buf, int count) {
+  struct simulation *sim = (struct simulation *)io;
+  sim->now += SIM_SYSCALL;
+
+  if (fd == SIM_FDSTDIN) {
+    sim->keytime[sim->keyread] = (sim->keyread + 1) * sim->keyinterval;
+    sim->keyread++;
+    buf[0] = 'k';
+    return 1;
+  }
+
+  int n = count < sim->count ? count : sim->count;
+  int i;
+  for (i = 0; i < n; i++)
+    buf[i] = sim->queue[(sim->head + i) % sizeof(sim->queue)];
+  sim->head = (sim->head + n) % sizeof(sim->queue);
+  sim->count -= n;
+  sim->dequeued += n;
+  sim->reads++;
+
+  while (sim->keydelivered < sim->keyn &&
+         sim->keypos[sim->keydelivered] < sim->dequeued)
+    sim->keydelivered++;
+
+  return n;
+}
 
-  if (ansicolourreset(stdout) == -1)
+
+int simwrite(struct io *io, int fd, const char *buf, int count) {
+  struct simulation *sim = (struct simulation *)io;
+  sim->now += SIM_SYSCALL;
+
+  int i;
+  for (i = 0; i < count; i++) {
+    sim->keypos[sim->keyn++] = sim->enqueued;
+    simenqueue(sim, buf + i, 1);
+  }
+
+  return count;
+}
+
+
+struct workload {
+  const char *name;
+  const char *pattern;
+  long long rate;
+  long long bandwidth;
+  long long keyinterval;
+  int keys;
+};
+
+
+int simulate(const struct workload *w, int compress, int eightbit) {
+  struct simulation *sim = calloc(1, sizeof(*sim));
+  if (!sim)
+    return returnperror("calloc()", -1);
+
+  sim->io = (struct io){ simselect, simread, simwrite };
+  sim->pattern = w->pattern;
+  sim->rate = w->rate;
+  sim->total = w->rate;
+  sim->bandwidth = w->bandwidth;
+  sim->keyinterval = w->keyinterval;
+  sim->keys = w->keys;
+
+  if ((sim->stream = open_memstream(&sim->buf, &sim->size)) == NULL)
+    return returnperror("open_memstream()", -1);
+
+  g_compress = compress;
+  g_8bit = eightbit;
+  srandom(1);
+
+  if (loop(&sim->io, sim->stream, SIM_FDSTDIN, SIM_FDMASTER, 0, NULL) == -1)
     return -1;
+  fclose(sim->stream);
+  free(sim->buf);
+
+  printf("%-12s %-14s %9lld %10lld %7.2f %9.1f %9.1f %8.2f %8.2f %6d\n",
+         w->name,
+         compress && eightbit ? "compress,8bit" :
+           compress ? "compress" : eightbit ? "8bit" : "plain",
+         sim->produced,
+         sim->bytesout,
+         sim->bytesout * 1.0 / sim->produced,
+         sim->donetime * 1000.0 / SIM_NS,
+         sim->produced * 1.0 / 1024 / sim->donetime * SIM_NS,
+         sim->keydisplayed ?
+           sim->latency * 1000.0 / SIM_NS / sim->keydisplayed : 0.0,
+         sim->latencymax * 1000.0 / SIM_NS,
+         sim->reads);
+
+  free(sim);
+  return 0;
+}
+
+
+int simulationusage(FILE *stream, int status) {
+  fputs("Usage:  rainbow --simulate [ --rate bytes ] [ --bandwidth bytes ]\n"
+        "                           [ --keys n ] [ --keyinterval ms ]\n",
+        stream);
+  return status;
+}
+
+
+int simulation(int argc, const char **argv) {
+  struct workload workloads[] = {
+    { "text",       "The quick brown fox jumps over the lazy dog.\r\n",
+      256 * 1024, 2 * 1024 * 1024, 20000000, 50 },
+    { "separators", "================================================"
+                    "================================\r\n",
+      256 * 1024, 2 * 1024 * 1024, 20000000, 50 },
+    { "boxes",      "┌───────"
+                    "────────"
+                    "────────"
+                    "───────┐\r\n",
+      256 * 1024, 2 * 1024 * 1024, 20000000, 50 },
+    { "blanks",     "name                                        "
+                    "                       value\r\n",
+      256 * 1024, 2 * 1024 * 1024, 20000000, 50 },
+    { "progress",   "\r[########################                "
+                    "        ]  42%",
+      64 * 1024, 2 * 1024 * 1024, 20000000, 50 },
+  };
+  int nworkloads = sizeof(workloads) / sizeof(workloads[0]);
+
+  int i;
+  for (; argc > 2; argc -= 2, argv += 2) {
+    long long n = strtoll(argv[2], NULL, 10);
+    if (n <= 0)
+      return simulationusage(stderr, EXIT_FAILURE);
+
+    for (i = 0; i < nworkloads; i++)
+      if (strcmp(argv[1], "--rate") == 0)
+        workloads[i].rate = n;
+      else if (strcmp(argv[1], "--bandwidth") == 0)
+        workloads[i].bandwidth = n;
+      else if (strcmp(argv[1], "--keys") == 0 && n <= SIM_KEYS)
+        workloads[i].keys = n;
+      else if (strcmp(argv[1], "--keyinterval") == 0)
+        workloads[i].keyinterval = n * 1000000;
+      else
+        return simulationusage(stderr, EXIT_FAILURE);
+  }
+
+  if (argc != 1)
+    return simulationusage(stderr, EXIT_FAILURE);
+
+  printf("%-12s %-14s %9s %10s %7s %9s %9s %8s %8s %6s\n",
+         "workload", "mode", "in", "out", "out/in", "time(ms)",
+         "in(KB/s)", "lat(ms)", "max(ms)", "reads");
+
+  for (i = 0; i < nworkloads; i++)
+    if (simulate(&workloads[i], 0, 0) == -1 ||
+        simulate(&workloads[i], 1, 0) == -1 ||
+        simulate(&workloads[i], 0, 1) == -1 ||
+        simulate(&workloads[i], 1, 1) == -1)
+      return -1;
 
   return 0;
 }
@@ -582,6 +1383,10 @@ int start(const char **argv, const char **envp) {
 
   srandom(time(NULL));
 
+  struct writer transcript;
+  if (g_transcript && writeropen(&transcript, g_transcript) == -1)
+    return -1;
+
   int fdmaster, fdslave;
   if (pty(&fdmaster, &fdslave) == -1)
     return EXIT_FAILURE;
@@ -590,7 +1395,8 @@ int start(const char **argv, const char **envp) {
   if (pid == -1)
     return returnperror("fork()", -1);
   else if (pid != 0)
-    return parent(fdmaster, fdslave, pid);
+    return parent(fdmaster, fdslave, pid,
+                  g_transcript ? &transcript : NULL);
   else
     return child(fdslave, argv, envp);
 
@@ -625,8 +1431,483 @@ char *searchpath(const char *var, const char *name, char *buf, int buflen) {
 }
 
 
+/*
+  - tmux:
+    - Runs 'tmux -CC' on a pty and sits between it and the terminal, for
+      terminals with tmux integration such as iTerm2.  The DCS
+      'ESC P 1000 p' that starts integration and the ST that ends it are
+      passed through, as are commands from the terminal.
+    - %output and %extended-output notifications are decoded, colourised
+      with a context per pane and encoded again.  Other lines are passed
+      through unchanged.
+    - Panes are mapped to windows from %layout-change,
+      %window-pane-changed and 'list-panes -a', which is sent once tmux
+      has started and after each %window-add.  Its reply is not passed to
+      the terminal.  A pane's context is freed when it leaves its window's
+      layout, its window closes or it is missing from a list-panes reply.
+
+  - See:
+    - Control Mode.
+      - https://github.com/tmux/tmux/wiki/Control-Mode
+*/
+#define TMUX_LAYOUTPANES 1024
+#define TMUX_QUERY "list-panes -a -F 'rainbow-pane #{pane_id} #{window_id}'\n"
+#define TMUX_REPLY "rainbow-pane "
+
+
+struct pane {
+  int id;
+  int window;
+  int listed;
+  struct context c;
+  char *buf;
+  size_t size;
+};
+
+
+/*
+  - begin holds a %begin line and its end of line until the next line shows
+    whether it starts the reply to TMUX_QUERY.
+  - query is set while TMUX_QUERY is due and sent once tmux has started and
+    the terminal's input is at a line boundary.
+*/
+struct tmux {
+  struct pane **panes;
+  int npanes;
+
+  char *begin;
+  int listing;
+  int outstanding;
+  int query;
+  int started;
+  int newline;
+};
+
+
+struct pane *tmuxpane(struct tmux *t, int id) {
+  int i;
+  for (i = 0; i < t->npanes; i++)
+    if (t->panes[i]->id == id)
+      return t->panes[i];
+
+  struct pane **panes1 = realloc(t->panes,
+                                 (t->npanes + 1) * sizeof(*t->panes));
+  if (!panes1)
+    return NULL;
+  t->panes = panes1;
+
+  struct pane *p = malloc(sizeof(*p));
+  if (!p)
+    return NULL;
+
+  p->id = id;
+  p->window = -1;
+  p->listed = 0;
+  p->buf = NULL;
+  p->size = 0;
+
+  FILE *stream = open_memstream(&p->buf, &p->size);
+  if (!stream) {
+    free(p);
+    return NULL;
+  }
+  contextinit(&p->c, stream);
+
+  t->panes[t->npanes++] = p;
+  return p;
+}
+
+
+int tmuxpanefree(struct tmux *t, int i) {
+  fclose(t->panes[i]->c.stream);
+  free(t->panes[i]->buf);
+  free(t->panes[i]);
+  t->panes[i] = t->panes[--t->npanes];
+  return 0;
+}
+
+
+/*
+  - Layout:  'checksum,WxH,X,Y,pane' for a single pane, otherwise
+    'WxH,X,Y{...}' or 'WxH,X,Y[...]' holding comma separated cells.
+*/
+int tmuxlayout(const char *s, int *ids, int maxids) {
+  int nids = 0;
+  int w, h, x, y, n;
+
+  if ((s = strchr(s, ',')) == NULL)
+    return 0;
+  s++;
+
+  while (isdigit(*s) &&
+         sscanf(s, "%dx%d,%d,%d%n", &w, &h, &x, &y, &n) == 4) {
+    s += n;
+    if (*s == ',' && isdigit(s[1])) {
+      if (nids < maxids)
+        ids[nids++] = strtol(s + 1, (char **)&s, 10);
+      else
+        strtol(s + 1, (char **)&s, 10);
+    }
+    while (*s == ',' || *s == '{' || *s == '}' || *s == '[' || *s == ']')
+      s++;
+  }
+
+  return nids;
+}
+
+
+int tmuxwindow(struct tmux *t, char *line) {
+  int window;
+  int id;
+  int n = 0;
+  int i, j;
+
+  if (/* tmux:  '%layout-change @window layout ...': */
+        sscanf(line, "%%layout-change @%d %n", &window, &n) == 1 && n > 0) {
+    int ids[TMUX_LAYOUTPANES];
+    int nids = tmuxlayout(line + n, ids, TMUX_LAYOUTPANES);
+
+    for (i = 0; i < t->npanes; ) {
+      for (j = 0; j < nids && ids[j] != t->panes[i]->id; j++)
+        ;
+      if (t->panes[i]->window == window && j == nids)
+        tmuxpanefree(t, i);
+      else
+        i++;
+    }
+
+    for (j = 0; j < nids; j++) {
+      struct pane *p = tmuxpane(t, ids[j]);
+      if (!p)
+        return returnperror("tmuxpane()", -1);
+      p->window = window;
+    }
+  }
+  else if (/* tmux:  '%window-pane-changed @window %pane': */
+             sscanf(line, "%%window-pane-changed @%d %%%d",
+                    &window, &id) == 2) {
+    struct pane *p = tmuxpane(t, id);
+    if (!p)
+      return returnperror("tmuxpane()", -1);
+    p->window = window;
+  }
+  else if (/* tmux:  '%window-add @window': */
+             sscanf(line, "%%window-add @%d", &window) == 1)
+    t->query = 1;
+  else if (/* tmux:  '%window-close @window': */
+             sscanf(line, "%%window-close @%d", &window) == 1 ||
+           /* tmux:  '%unlinked-window-close @window': */
+             sscanf(line, "%%unlinked-window-close @%d", &window) == 1) {
+    for (i = 0; i < t->npanes; )
+      if (t->panes[i]->window == window)
+        tmuxpanefree(t, i);
+      else
+        i++;
+  }
+
+  return 0;
+}
+
+
+/*
+  - Returns 1 if line belongs to the reply to TMUX_QUERY, or is a %begin
+    held back until that is known, and so is not to be passed on.
+*/
+int tmuxreply(struct tmux *t, const char *line, const char *eol) {
+  int id;
+  int window;
+  int i;
+
+  if (t->listing) {
+    if (sscanf(line, TMUX_REPLY "%%%d @%d", &id, &window) == 2) {
+      struct pane *p = tmuxpane(t, id);
+      if (!p)
+        return returnperror("tmuxpane()", -1);
+      p->window = window;
+      p->listed = 1;
+    }
+    else if (strncmp(line, "%end ", 5) == 0) {
+      t->listing = 0;
+      for (i = 0; i < t->npanes; )
+        if (!t->panes[i]->listed)
+          tmuxpanefree(t, i);
+        else
+          i++;
+    }
+    else if (strncmp(line, "%error ", 7) == 0)
+      t->listing = 0;
+    return 1;
+  }
+
+  if (t->begin) {
+    char *begin = t->begin;
+    t->begin = NULL;
+
+    if (strncmp(line, TMUX_REPLY, strlen(TMUX_REPLY)) == 0) {
+      free(begin);
+      t->outstanding--;
+      t->listing = 1;
+      for (i = 0; i < t->npanes; i++)
+        t->panes[i]->listed = 0;
+      return tmuxreply(t, line, eol);
+    }
+
+    fputs(begin, stdout);
+    free(begin);
+  }
+
+  if (t->outstanding > 0 && strncmp(line, "%begin ", 7) == 0) {
+    if ((t->begin = malloc(strlen(line) + strlen(eol) + 1)) == NULL)
+      return returnperror("malloc()", -1);
+    strcat(strcpy(t->begin, line), eol);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+int tmuxdecode(char *s) {
+  char *t = s;
+  char *u = s;
+
+  while (*t) {
+    if (t[0] == '\\' &&
+        t[1] >= '0' && t[1] <= '7' &&
+        t[2] >= '0' && t[2] <= '7' &&
+        t[3] >= '0' && t[3] <= '7') {
+      *u++ = (t[1] - '0') * 64 + (t[2] - '0') * 8 + (t[3] - '0');
+      t += 4;
+    }
+    else
+      *u++ = *t++;
+  }
+
+  return u - s;
+}
+
+
+int tmuxencode(FILE *stream, const char *buf, int count) {
+  int i;
+  for (i = 0; i < count; i++)
+    if ((unsigned char)buf[i] < ' ' || buf[i] == '\\')
+      fprintf(stream, "\\%03o", (unsigned char)buf[i]);
+    else
+      fputc(buf[i], stream);
+
+  return 0;
+}
+
+
+int tmuxline(struct tmux *t, char *line, const char *eol,
+             float freq, float spread, float os) {
+  int id;
+  int n = 0;
+  char *data = NULL;
+
+  t->started = 1;
+
+  const char *dcs = "\x1bP1000p";
+  if (strncmp(line, dcs, strlen(dcs)) == 0) {
+    fputs(dcs, stdout);
+    line += strlen(dcs);
+  }
+
+  switch (tmuxreply(t, line, eol)) {
+  case -1:
+    return -1;
+  case 1:
+    return 0;
+  }
+
+  if (/* tmux:  '%output %pane value': */
+        sscanf(line, "%%output %%%d%n", &id, &n) == 1 &&
+        line[n] == ' ')
+    data = line + n + 1;
+  else if (/* tmux:  '%extended-output %pane age ... : value': */
+             sscanf(line, "%%extended-output %%%d%n", &id, &n) == 1 &&
+             (data = strstr(line + n, " : ")) != NULL)
+    data += 3;
+
+  if (!data) {
+    fputs(line, stdout);
+    fputs(eol, stdout);
+    return tmuxwindow(t, line);
+  }
+
+  struct pane *p = tmuxpane(t, id);
+  if (!p)
+    return returnperror("tmuxpane()", -1);
+
+  fwrite(line, 1, data - line, stdout);
+  output(&p->c, data, tmuxdecode(data), freq, spread, os);
+  tmuxencode(stdout, p->buf, p->size);
+  fputs(eol, stdout);
+  fseek(p->c.stream, 0, SEEK_SET);
+
+  return 0;
+}
+
+
+int tmuxloop(int fdstdin, int fdmaster) {
+  float freq = 0.1;
+  float spread = 3.0;
+  float os = random() * 1.0 / RAND_MAX * 255;
+
+  struct tmux t = { .query = 1, .newline = 1 };
+
+  fd_set readfds;
+  char buf[4096];
+  int nread;
+
+  char *line = NULL;
+  int linelen = 0;
+  int linesize = 0;
+
+  for (;;) {
+    if (t.query && t.started && t.newline) {
+      if (writeall(fdmaster, TMUX_QUERY, strlen(TMUX_QUERY)) == -1)
+        return returnperror("write()", -1);
+      t.query = 0;
+      t.outstanding++;
+    }
+
+    FD_ZERO(&readfds);
+    if (fdstdin != -1)
+      FD_SET(fdstdin, &readfds);
+    FD_SET(fdmaster, &readfds);
+
+    if (select(fdmaster + 1, &readfds, NULL, NULL, NULL) == -1) {
+      if (errno == EINTR)
+        continue;
+      else if (errno == EBADF)
+        break;
+      else
+        return returnperror("select()", -1);
+    }
+
+    if (fdstdin != -1 && FD_ISSET(fdstdin, &readfds)) {
+      nread = read(fdstdin, buf, sizeof(buf));
+      if (nread == -1)
+        return returnperror("read()", -1);
+      else if (nread == 0)
+        fdstdin = -1;
+      else if (writeall(fdmaster, buf, nread) == -1)
+        return returnperror("write()", -1);
+      else
+        t.newline = buf[nread - 1] == '\n' || buf[nread - 1] == '\r';
+    }
+
+    if (FD_ISSET(fdmaster, &readfds)) {
+      nread = read(fdmaster, buf, sizeof(buf));
+      if (nread == 0 ||
+          (nread == -1 && errno == EIO))
+        break;
+      else if (nread == -1)
+        return returnperror("read()", -1);
+
+      int i;
+      for (i = 0; i < nread; i++) {
+        if (linelen + 1 >= linesize) {
+          linesize = linesize ? linesize * 2 : 4096;
+          if ((line = realloc(line, linesize)) == NULL)
+            return returnperror("realloc()", -1);
+        }
+
+        if (buf[i] != '\n') {
+          line[linelen++] = buf[i];
+          continue;
+        }
+
+        const char *eol = "\n";
+        if (linelen > 0 && line[linelen - 1] == '\r') {
+          eol = "\r\n";
+          linelen--;
+        }
+
+        line[linelen] = '\0';
+        linelen = 0;
+        if (tmuxline(&t, line, eol, freq, spread, os) == -1)
+          return -1;
+      }
+
+      fflush(stdout);
+    }
+  }
+
+  /* The ST ending integration follows the last line unterminated. */
+  if (t.begin)
+    fputs(t.begin, stdout);
+  fwrite(line, 1, linelen, stdout);
+  fflush(stdout);
+
+  while (t.npanes > 0)
+    tmuxpanefree(&t, 0);
+  free(t.panes);
+  free(t.begin);
+  free(line);
+
+  return 0;
+}
+
+
+int starttmux(const char **argv, const char **envp) {
+  char buf[FILENAME_MAX];
+  if (!searchpath("PATH", "tmux", buf, FILENAME_MAX))
+    return returnperror("access()", -1);
+
+  int argc;
+  for (argc = 1; argv[argc]; argc++)
+    ;
+
+  const char **argv1 = calloc(argc + 2, sizeof(*argv1));
+  if (!argv1)
+    return returnperror("calloc()", -1);
+  argv1[0] = buf;
+  argv1[1] = "-CC";
+  memcpy(argv1 + 2, argv + 1, argc * sizeof(*argv1));
+
+  srandom(time(NULL));
+
+  int fdmaster, fdslave;
+  if (pty(&fdmaster, &fdslave) == -1)
+    return EXIT_FAILURE;
+
+  int pid = fork();
+  if (pid == -1)
+    return returnperror("fork()", -1);
+  else if (pid == 0)
+    return child(fdslave, argv1, envp);
+
+  free(argv1);
+
+  int tty = isatty(STDIN_FILENO);
+  if (tty && windowsizecopy(STDIN_FILENO, fdmaster) == -1)
+    return -1;
+
+  if (signals(STDIN_FILENO, fdmaster, fdslave) == -1)
+    return -1;
+
+  struct termios t;
+  if (tty && termiosraw(STDIN_FILENO, &t) == -1)
+    return -1;
+
+  int status = tmuxloop(STDIN_FILENO, fdmaster);
+
+  if (tty && termiosreset(STDIN_FILENO, &t) == -1)
+    return -1;
+
+  return status;
+}
+
+
 int usage(FILE *stream, int status) {
-  fputs("Usage:  rainbow [ command [ arg ... ] ]\n", stream);
+  fputs("Usage:  rainbow [ --8bit ] [ --compress ] [ --transcript file ]\n"
+        "                [ command [ arg ... ] ]\n"
+        "        rainbow --strip\n"
+        "        rainbow --simulate [ option ... ]\n"
+        "        rainbow --tmux [ tmux-command [ arg ... ] ]\n",
+        stream);
   return status;
 }
 
@@ -654,9 +1935,32 @@ int startsearchpath(const char **argv, const char **envp) {
 
 
 int main(int argc, const char **argv, const char **envp) {
-  if (argc == 2 && strcmp(argv[1], "--help") == 0)
-    return usage(stdout, EXIT_SUCCESS);
-  else if (argc == 1)
+  for (; argc > 1 && strncmp(argv[1], "--", 2) == 0; argc--, argv++) {
+    if (strcmp(argv[1], "--") == 0) {
+      argc--, argv++;
+      break;
+    }
+    else if (strcmp(argv[1], "--help") == 0)
+      return usage(stdout, EXIT_SUCCESS);
+    else if (strcmp(argv[1], "--8bit") == 0)
+      g_8bit = 1;
+    else if (strcmp(argv[1], "--compress") == 0)
+      g_compress = 1;
+    else if (strcmp(argv[1], "--strip") == 0 && argc == 2)
+      return stripfilter(STDIN_FILENO, STDOUT_FILENO);
+    else if (strcmp(argv[1], "--simulate") == 0)
+      return simulation(argc - 1, argv + 1);
+    else if (strcmp(argv[1], "--tmux") == 0 && !g_transcript)
+      return starttmux(argv + 1, envp);
+    else if (strcmp(argv[1], "--transcript") == 0 && argc > 2) {
+      g_transcript = argv[2];
+      argc--, argv++;
+    }
+    else
+      return usage(stderr, EXIT_FAILURE);
+  }
+
+  if (argc == 1)
     return startshell(argv, envp);
   else if (strchr(argv[1], '/'))
     return startpath(argv, envp);